@@ -0,0 +1,22 @@
+#include "uthread_task.h"
+
+namespace uthread {
+namespace detail {
+
+void resume(void* task){
+    std::coroutine_handle<>::from_address(task).resume();
+}
+
+}
+
+int spawn(task<void> t){
+    std::coroutine_handle<task<void>::promise_type> handle = t.release();
+    handle.promise().detached = true;
+    if (detail::schedule_task(handle.address(), 0, &detail::resume) == -1){
+        handle.destroy();
+        return -1;
+    }
+    return 0;
+}
+
+}
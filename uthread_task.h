@@ -0,0 +1,211 @@
+/*
+ * Stackless coroutine tasks for the User-Level Threads Library (uthreads).
+ *
+ * A task is a C++20 coroutine that has no stack of its own. All the tasks are run, one after the other, by a
+ * single library thread (the task host), which the library spawns the first time a task is scheduled and which is
+ * counted in MAX_THREAD_NUM. The host is scheduled like any other thread, so tasks share the quantums with the
+ * threads. Task frames are allocated from an arena owned by the library instead of the general heap.
+ *
+ * A task runs on the task host's thread, so a blocking library call made from a task (uthread_sleep,
+ * uthread_sleep_until, uthread_block or uthread_block_until on itself) blocks the task host, and with it every
+ * other task, until the host thread is READY again. Tasks should co_await uthread::sleep or uthread::yield instead.
+ *
+ * This header requires C++20, build with -DUTHREADS_ENABLE_TASKS=ON. The library itself stays C++11, so a target
+ * that includes this header links uthread_task and sets its own CXX_STANDARD to 20.
+ */
+
+#ifndef _UTHREAD_TASK_H
+#define _UTHREAD_TASK_H
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include "uthreads.h"
+
+namespace uthread {
+
+template <typename T = void>
+class task;
+
+namespace detail {
+
+/* Implemented in uthreads.cpp. Adds the coroutine at address task to the tasks run by the task host, after
+ * num_quantums quantums have passed (counted as in uthread_sleep), or right away if num_quantums is 0. */
+int schedule_task(void *task, int num_quantums, void (*resume)(void *));
+
+/* Implemented in uthreads.cpp. Task frames live in the library's shared arena, frame_alloc returns null when no
+ * memory is left. */
+void *frame_alloc(std::size_t size);
+void frame_free(void *frame, std::size_t size);
+
+void resume(void *task);
+
+struct promise_base {
+    std::coroutine_handle<> continuation;
+    bool detached = false;
+
+    static void *operator new(std::size_t size)
+    {
+        void *frame = frame_alloc(size);
+        if (frame == nullptr) {
+            throw std::bad_alloc();
+        }
+        return frame;
+    }
+
+    static void operator delete(void *frame, std::size_t size) { frame_free(frame, size); }
+
+    struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            promise_base &promise = handle.promise();
+            if (promise.continuation) {
+                // Return to the task that awaited this one.
+                return promise.continuation;
+            }
+            if (promise.detached) {
+                // Nobody owns a spawned task, it frees itself.
+                handle.destroy();
+            }
+            return std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    final_awaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { std::terminate(); }
+};
+
+template <typename T>
+struct promise : promise_base {
+    std::optional<T> value;
+
+    task<T> get_return_object() noexcept;
+    void return_value(T result) { value.emplace(std::move(result)); }
+};
+
+template <>
+struct promise<void> : promise_base {
+    task<void> get_return_object() noexcept;
+    void return_void() noexcept {}
+};
+
+struct sleep_awaiter {
+    int num_quantums;
+
+    bool await_ready() noexcept { return false; }
+
+    bool await_suspend(std::coroutine_handle<> handle) noexcept
+    {
+        // If the task could not be scheduled, it just goes on running.
+        return schedule_task(handle.address(), num_quantums, &resume) == 0;
+    }
+
+    void await_resume() noexcept {}
+};
+
+}
+
+/**
+ * @brief A lazily started coroutine that produces a T.
+ *
+ * A task starts running when it is awaited by another task (co_await returns its result), or when it is handed
+ * to uthread::spawn. A task that is destroyed before being started is never run.
+ */
+template <typename T>
+class task {
+public:
+    using promise_type = detail::promise<T>;
+
+    explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    task(task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    task &operator=(task &&other) noexcept
+    {
+        if (this != &other) {
+            if (handle) {
+                handle.destroy();
+            }
+            handle = std::exchange(other.handle, {});
+        }
+        return *this;
+    }
+
+    ~task()
+    {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept { return false; }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume()
+    {
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*handle.promise().value);
+        }
+    }
+
+    std::coroutine_handle<promise_type> release() noexcept { return std::exchange(handle, {}); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+task<T> detail::promise<T>::get_return_object() noexcept
+{
+    return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object() noexcept
+{
+    return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+
+/**
+ * @brief Starts running the task t alongside the threads.
+ *
+ * The task is added to the end of the tasks run by the task host and frees itself once it completes. The first call
+ * spawns the task host, so it fails if that would exceed MAX_THREAD_NUM.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int spawn(task<void> t);
+
+
+/**
+ * @brief Suspends the calling task for num_quantums quantums (co_await uthread::sleep(n)).
+ *
+ * The quantums are counted as in uthread_sleep. Other tasks keep running on the task host in the meantime.
+*/
+inline detail::sleep_awaiter sleep(int num_quantums) { return detail::sleep_awaiter{num_quantums}; }
+
+
+/**
+ * @brief Moves the calling task to the end of the tasks run by the task host (co_await uthread::yield()).
+*/
+inline detail::sleep_awaiter yield() { return detail::sleep_awaiter{0}; }
+
+}
+
+#endif
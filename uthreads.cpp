@@ -1,12 +1,19 @@
 #include <stdio.h>
+#include <cstddef>
 #include <setjmp.h>
 #include <csignal>
 #include <iostream>
 #include "uthreads.h"
 #include <deque>
 #include <sys/time.h>
+#include <time.h>
 #include <set>
+#include <map>
+#include <vector>
 #include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
 
 typedef unsigned long address_t;
 #define JB_SP 6
@@ -15,6 +22,14 @@ typedef unsigned long address_t;
 #define MAX_THREAD_NUM 100 /* maximal number of threads */
 #define STACK_SIZE 4096 /* stack size per thread (in bytes) */
 
+#define ARENA_CHUNK_SIZE 16384 /* arenas grow by chunks of this size and alignment (in bytes) */
+#define ARENA_MIN_BLOCK 16 /* size of the smallest size class (in bytes) */
+#define ARENA_SIZE_CLASSES 8 /* size classes of 16, 32, ..., 2048 bytes */
+#define ARENA_LARGE_CLASS ARENA_SIZE_CLASSES /* blocks too large for a size class */
+#define SHARED_ARENA_OWNER (-1)
+
+#define DEADLINE_SIGNAL SIGRTMIN /* raised by the deadline timer, see uthread_sleep_until */
+
 #define SECOND 1000000
 #define SYSTEM_ERROR "system error: "
 #define THREAD_ERROR "thread library error: "
@@ -26,6 +41,16 @@ typedef unsigned long address_t;
 #define SIGACTION_ERROR "sigaction error"
 #define SETTIME_ERROR "set-timer error"
 #define QUANTUM_NUM_ERROR "The quantums number is illegal"
+#define IDLE_NOT_MAIN_ERROR "Only the main thread may go idle"
+#define STATS_ERROR "The stats pointer is null"
+#define TICKS_ERROR "Quantum_ticks is not positive"
+#define RANDOM_TICKS_ERROR "Quantum_ticks is too large for random quantums"
+#define SCHEDULE_ERROR "The schedule is invalid"
+#define ALLOC_ERROR "The memory could not be allocated"
+#define FREE_OWNER_ERROR "The memory was not allocated by the calling thread"
+#define SIMULATED_DEADLINE_ERROR "Deadlines cannot be used with a simulated clock"
+#define TIMER_CREATE_ERROR "timer_create error"
+#define NANOSECOND 1000000000ULL
 
 /* A translation is required when using an address of a variable.
    Use this as a black box in your code. */
@@ -42,6 +67,52 @@ enum State {
     RUNNING, READY, BLOCKED
 };
 
+void thread_start();
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct alignas(std::max_align_t) ChunkHeader {
+    // Starts every chunk. Chunks are aligned to ARENA_CHUNK_SIZE, so the
+    // header of a block is found by masking the block's address, and the
+    // alignment keeps the blocks aligned like the ones returned by malloc.
+    ChunkHeader* prev;
+    ChunkHeader* next;
+    int size_class;
+    int owner;
+};
+
+class Arena {
+public:
+    // Size-class slabs carved with a bump pointer out of chunks, each chunk
+    // holding blocks of a single size class. The owner and the size class
+    // are kept once per chunk, so the blocks have no header of their own.
+    // Freed blocks go to a free list per size class, and all the chunks are
+    // released at once when the arena is destroyed.
+    explicit Arena(int owner): owner(owner), chunks(nullptr)
+    {
+        for (int i = 0; i < ARENA_SIZE_CLASSES; i++) {
+            bump[i] = nullptr;
+            bump_end[i] = nullptr;
+            free_lists[i] = nullptr;
+        }
+    }
+
+    ~Arena();
+    void* alloc(size_t size);
+    void free(void* ptr);
+
+private:
+    int owner;
+    char* bump[ARENA_SIZE_CLASSES];
+    char* bump_end[ARENA_SIZE_CLASSES];
+    FreeBlock* free_lists[ARENA_SIZE_CLASSES];
+    ChunkHeader* chunks;
+
+    ChunkHeader* add_chunk(size_t size, int size_class);
+};
+
 class Thread {
 public:
     int tid;
@@ -52,15 +123,31 @@ public:
     int num_quantum;
     int wakeup_quantum;
     bool is_blocked = false;
+    // Real-time deadlines (0 if none): the end of uthread_sleep_until, and
+    // the time at which uthread_block_until resumes the thread.
+    unsigned long long sleep_deadline_ns = 0;
+    unsigned long long block_deadline_ns = 0;
+    bool timed_out = false;
+    Arena arena;
+
+    // Statistics, see uthread_get_stats.
+    unsigned long long state_since_ns = 0;
+    unsigned long long run_ns = 0;
+    unsigned long long ready_ns = 0;
+    unsigned long long blocked_ns = 0;
+    unsigned long voluntary_switches = 0;
+    unsigned long involuntary_switches = 0;
 
-    Thread(int tid, char *stack, thread_entry_point entry_point)
+    Thread(int tid, char *stack, thread_entry_point entry_point): arena(tid)
     {
         // initializes env[tid] to use the right stack,
-        // and to run from the function 'entry_point', when we'll use
-        // siglongjmp to jump into the thread.
+        // and to run from thread_start, which calls 'entry_point', when
+        // we'll use siglongjmp to jump into the thread.
         this->tid = tid;
+        this->stack = stack;
+        this->entry_point = entry_point;
         address_t sp = (address_t) stack + STACK_SIZE - sizeof(address_t);
-        address_t pc = (address_t) entry_point;
+        address_t pc = (address_t) thread_start;
         sigsetjmp(env, 1);
         num_quantum = 0;
         wakeup_quantum = 0;
@@ -68,7 +155,8 @@ public:
         (env->__jmpbuf)[JB_PC] = translate_address(pc);
         sigemptyset(&env->__saved_mask);
     }
-    Thread(int tid): tid(tid), state(RUNNING), num_quantum(1){};
+    Thread(int tid): tid(tid), state(RUNNING), stack(nullptr), num_quantum(1),
+    arena(tid){};
 
     ~Thread(){
         delete[] stack;
@@ -84,10 +172,81 @@ public:
     sigset_t* signals;
     Thread** all_threads;
     std::set<Thread*> sleeping_threads;
-    ThreadScheduler(){
+
+    // Real-time deadlines on CLOCK_MONOTONIC, served by a POSIX timer that
+    // raises DEADLINE_SIGNAL at the earliest one (or at idle_until_ns, when the main
+    // thread idles until then). The timer is not created with a simulated
+    // clock, which has no deadlines.
+    std::multimap<unsigned long long, Thread*> sleep_deadlines;
+    std::multimap<unsigned long long, Thread*> block_deadlines;
+    bool has_deadline_timer;
+    timer_t deadline_timer;
+    unsigned long long armed_ns;
+    unsigned long long idle_until_ns;
+    // Set while the main thread waits in wait_idle, which runs the threads
+    // woken by the deadlines itself.
+    bool idling;
+
+    // Coroutine tasks (see uthread_task.h), run one after the other by the
+    // task host thread. Tasks are kept as opaque coroutine addresses.
+    Thread* task_host;
+    // Set only while the task host has blocked itself for lack of tasks,
+    // so that a host that sleeps or was blocked by the user is not woken.
+    bool task_host_idle;
+    void (*resume_task)(void*);
+    std::deque<void*> ready_tasks;
+    std::multimap<int, void*> sleeping_tasks;
+
+    // Simulated clock, see uthread_init_simulated. A quantum lasts a number
+    // of uthread_tick calls instead of a period of the virtual timer.
+    bool simulated;
+    int quantum_ticks;
+    int ticks_left;
+    unsigned int random_state;
+    std::vector<int> replay;
+    size_t replay_position;
+    std::vector<int> schedule;
+
+    // Memory shared by all the threads, such as coroutine task frames.
+    Arena shared_arena;
+    // The RUNNING thread, which unlike threads_queue can be read without
+    // blocking the signals: a thread always finds itself there.
+    Thread* running;
+    // A thread that terminated itself, freed once another thread runs,
+    // since it cannot release the stack it is running on.
+    Thread* terminated;
+
+    // Statistics, see uthread_get_sched_stats.
+    unsigned long long switch_start_ns;
+    unsigned long total_switches;
+    unsigned long long idle_ns;
+    unsigned long switch_latency[SWITCH_LATENCY_BUCKETS];
+    ThreadScheduler(): shared_arena(SHARED_ARENA_OWNER){
         total_quantum = 1;
+        has_deadline_timer = false;
+        armed_ns = 0;
+        idle_until_ns = 0;
+        idling = false;
+        task_host = nullptr;
+        task_host_idle = false;
+        resume_task = nullptr;
+        terminated = nullptr;
+        running = nullptr;
+        simulated = false;
+        quantum_ticks = 0;
+        ticks_left = 0;
+        random_state = 0;
+        replay_position = 0;
+        switch_start_ns = 0;
+        total_switches = 0;
+        idle_ns = 0;
+        for (int i = 0; i < SWITCH_LATENCY_BUCKETS; i++) {
+            switch_latency[i] = 0;
+        }
+        signals = new sigset_t;
         sigemptyset(signals);
         sigaddset(signals, SIGVTALRM);
+        sigaddset(signals, DEADLINE_SIGNAL);
 
         all_threads = new Thread*[MAX_THREAD_NUM];
         for (int i = 0; i < MAX_THREAD_NUM; i++) {
@@ -104,7 +263,12 @@ public:
                 delete all_threads[i];
             }
         }
-        delete all_threads;
+        delete terminated;
+        if (has_deadline_timer){
+            timer_delete(deadline_timer);
+        }
+        delete[] all_threads;
+        delete signals;
     }
 };
 ThreadScheduler *scheduler = new ThreadScheduler();
@@ -112,16 +276,215 @@ struct sigaction sa = {0};
 struct itimerval timer;
 
 
+ChunkHeader* chunk_of(void* ptr){
+    return reinterpret_cast<ChunkHeader*>(reinterpret_cast<uintptr_t>(ptr) &
+                                          ~((uintptr_t) ARENA_CHUNK_SIZE - 1));
+}
+
+ChunkHeader* Arena::add_chunk(size_t size, int size_class){
+    // The heap is not safe against preemption, so the signals are blocked
+    // (or kept blocked) while it is used.
+    sigset_t old_mask;
+    sigprocmask(SIG_BLOCK, scheduler->signals, &old_mask);
+    void* memory;
+    if (posix_memalign(&memory, ARENA_CHUNK_SIZE, size) != 0){
+        memory = nullptr;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+    if (memory == nullptr){
+        return nullptr;
+    }
+    ChunkHeader* chunk = static_cast<ChunkHeader*>(memory);
+    chunk->size_class = size_class;
+    chunk->owner = owner;
+    chunk->prev = nullptr;
+    chunk->next = chunks;
+    if (chunks != nullptr){
+        chunks->prev = chunk;
+    }
+    chunks = chunk;
+    return chunk;
+}
+
+Arena::~Arena(){
+    while (chunks != nullptr){
+        ChunkHeader* next = chunks->next;
+        std::free(chunks);
+        chunks = next;
+    }
+}
+
+void* Arena::alloc(size_t size){
+    int size_class = 0;
+    while (size_class < ARENA_SIZE_CLASSES &&
+    ((size_t) ARENA_MIN_BLOCK << size_class) < size){
+        size_class++;
+    }
+    if (size_class == ARENA_LARGE_CLASS){
+        // Too large for a slab, gets a chunk of its own. The block starts
+        // within the first ARENA_CHUNK_SIZE bytes, so it still finds it.
+        if (size > SIZE_MAX - sizeof(ChunkHeader)){
+            return nullptr;
+        }
+        ChunkHeader* chunk = add_chunk(sizeof(ChunkHeader) + size,
+                                       ARENA_LARGE_CLASS);
+        if (chunk == nullptr){
+            return nullptr;
+        }
+        return chunk + 1;
+    }
+    if (free_lists[size_class] != nullptr){
+        FreeBlock* block = free_lists[size_class];
+        free_lists[size_class] = block->next;
+        return block;
+    }
+    size_t block_size = (size_t) ARENA_MIN_BLOCK << size_class;
+    if ((size_t) (bump_end[size_class] - bump[size_class]) < block_size){
+        // The rest of the current chunk of the class is dropped.
+        ChunkHeader* chunk = add_chunk(ARENA_CHUNK_SIZE, size_class);
+        if (chunk == nullptr){
+            return nullptr;
+        }
+        bump[size_class] = reinterpret_cast<char*>(chunk + 1);
+        bump_end[size_class] = reinterpret_cast<char*>(chunk) +
+                               ARENA_CHUNK_SIZE;
+    }
+    void* block = bump[size_class];
+    bump[size_class] += block_size;
+    return block;
+}
+
+void Arena::free(void* ptr){
+    ChunkHeader* chunk = chunk_of(ptr);
+    int size_class = chunk->size_class;
+    if (size_class == ARENA_LARGE_CLASS){
+        if (chunk->prev != nullptr){
+            chunk->prev->next = chunk->next;
+        }
+        else{
+            chunks = chunk->next;
+        }
+        if (chunk->next != nullptr){
+            chunk->next->prev = chunk->prev;
+        }
+        sigset_t old_mask;
+        sigprocmask(SIG_BLOCK, scheduler->signals, &old_mask);
+        std::free(chunk);
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        return;
+    }
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = free_lists[size_class];
+    free_lists[size_class] = block;
+}
+
+int block_owner(void* ptr){
+    return chunk_of(ptr)->owner;
+}
+
+
+unsigned long long now_ns(){
+    // CLOCK_MONOTONIC is served by the vDSO, so this does not enter the
+    // kernel and is cheap enough for the switch path.
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * NANOSECOND + ts.tv_nsec;
+}
+
+void set_state(Thread* thread, State state, unsigned long long now){
+    // Charges the time since the last transition to the state being left.
+    unsigned long long elapsed = now - thread->state_since_ns;
+    switch (thread->state){
+        case RUNNING:
+            thread->run_ns += elapsed;
+            break;
+        case READY:
+            thread->ready_ns += elapsed;
+            break;
+        case BLOCKED:
+            thread->blocked_ns += elapsed;
+            break;
+    }
+    thread->state = state;
+    thread->state_since_ns = now;
+    if (state == RUNNING){
+        scheduler->running = thread;
+    }
+}
+
+void start_switch(unsigned long long now){
+    scheduler->switch_start_ns = now;
+    scheduler->total_switches++;
+}
+
+void finish_switch(){
+    // Called by the thread being switched to, once it runs again.
+    if (scheduler->terminated != nullptr){
+        delete scheduler->terminated;
+        scheduler->terminated = nullptr;
+    }
+    if (scheduler->switch_start_ns == 0){
+        return;
+    }
+    unsigned long long latency = now_ns() - scheduler->switch_start_ns;
+    scheduler->switch_start_ns = 0;
+    int bucket = 0;
+    for (latency >>= 7; latency > 0 && bucket < SWITCH_LATENCY_BUCKETS - 1;
+    latency >>= 1){
+        bucket++;
+    }
+    scheduler->switch_latency[bucket]++;
+}
+
+void thread_start(){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    finish_switch();
+    // Read while the signals are blocked, threads_queue may change once
+    // they are not.
+    thread_entry_point entry_point = scheduler->running->entry_point;
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    entry_point();
+}
+
+
+void wake_task_host(){
+    Thread* host = scheduler->task_host;
+    if (host != nullptr && scheduler->task_host_idle &&
+    host->state == BLOCKED){
+        scheduler->task_host_idle = false;
+        host->is_blocked = false;
+        set_state(host, READY, now_ns());
+        scheduler->threads_queue.push_back(host);
+    }
+}
+
+void wake_up_tasks(){
+    auto it = scheduler->sleeping_tasks.begin();
+    while (it != scheduler->sleeping_tasks.end() &&
+    it->first <= scheduler->total_quantum){
+        scheduler->ready_tasks.push_back(it->second);
+        it = scheduler->sleeping_tasks.erase(it);
+    }
+    if (!scheduler->ready_tasks.empty()){
+        wake_task_host();
+    }
+}
+
 void wake_up_threads(){
+    wake_up_tasks();
     if(scheduler->sleeping_threads.empty()){
         return;
     }
+    unsigned long long now = 0;
     auto it = scheduler->sleeping_threads.begin();
     while (it != scheduler->sleeping_threads.end()){
         if ((*it)->wakeup_quantum == scheduler->total_quantum){
             (*it)->wakeup_quantum = 0;
             if (!((*it)->is_blocked)){
-                (*it)->state = READY;
+                if (now == 0){
+                    now = now_ns();
+                }
+                set_state(*it, READY, now);
                 scheduler->threads_queue.push_back(*it);
             }
             it = scheduler->sleeping_threads.erase(it);
@@ -132,6 +495,24 @@ void wake_up_threads(){
     }
 }
 
+int next_wakeup_quantum(){
+    // The earliest quantum in which a sleeping thread becomes READY,
+    // or 0 if no thread is sleeping.
+    int wakeup = 0;
+    for (Thread* thread : scheduler->sleeping_threads){
+        if (wakeup == 0 || thread->wakeup_quantum < wakeup){
+            wakeup = thread->wakeup_quantum;
+        }
+    }
+    if (!scheduler->sleeping_tasks.empty()){
+        int task_wakeup = scheduler->sleeping_tasks.begin()->first;
+        if (wakeup == 0 || task_wakeup < wakeup){
+            wakeup = task_wakeup;
+        }
+    }
+    return wakeup;
+}
+
 void increase_quantum(Thread* next_thread) {
     scheduler->total_quantum++;
     next_thread->num_quantum++;
@@ -143,27 +524,61 @@ void timer_handler(int sig){
     if(!scheduler->threads_queue.empty()){
         scheduler->total_quantum++;
         wake_up_threads();
+        unsigned long long now = now_ns();
         Thread* cur_thread = scheduler->threads_queue.front();
         scheduler->threads_queue.pop_front();
-        cur_thread->state = READY;
+        set_state(cur_thread, READY, now);
         scheduler->threads_queue.push_back(cur_thread);
         Thread* next_thread = scheduler->threads_queue.front();
-        next_thread->state = RUNNING;
+        set_state(next_thread, RUNNING, now);
         next_thread->num_quantum++;
+        if (next_thread == cur_thread){
+            // Nobody else is READY, keep running.
+            sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+            return;
+        }
+        cur_thread->involuntary_switches++;
+        start_switch(now);
         int ret_val = sigsetjmp(cur_thread->env, 1);
         bool did_just_save_bookmark = ret_val == 0;
         if(did_just_save_bookmark){
-            sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
             siglongjmp(next_thread->env, 1);
         }
+        finish_switch();
     }
     sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
 }
 
 
 
+int next_quantum_ticks(){
+    int ticks;
+    if (scheduler->replay_position < scheduler->replay.size()){
+        ticks = scheduler->replay[scheduler->replay_position++];
+    }
+    else if (scheduler->random_state != 0){
+        // xorshift32, uniform in [1, 2 * quantum_ticks - 1].
+        unsigned int x = scheduler->random_state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        scheduler->random_state = x;
+        ticks = 1 + (int) (x % (2 * (unsigned int) scheduler->quantum_ticks - 1));
+    }
+    else{
+        ticks = scheduler->quantum_ticks;
+    }
+    scheduler->schedule.push_back(ticks);
+    return ticks;
+}
+
 void reset_timer(int quantum_usecs){
+    if (scheduler->simulated){
+        scheduler->ticks_left = next_quantum_ticks();
+        return;
+    }
     sa.sa_handler = &timer_handler;
+    sa.sa_mask = *scheduler->signals;
     if (sigaction(SIGVTALRM, &sa, NULL) < 0)
     {
         std::cerr << SYSTEM_ERROR << SIGACTION_ERROR << std::endl;
@@ -181,37 +596,253 @@ void reset_timer(int quantum_usecs){
     }
 }
 
+void switch_from_running(Thread* cur_thread, unsigned long long now){
+    // cur_thread, the running thread, has just stopped being READY. Switches
+    // to the next READY thread and returns once cur_thread runs again.
+    cur_thread->voluntary_switches++;
+    scheduler->threads_queue.pop_front();
+    Thread* next_thread = scheduler->threads_queue.front();
+    set_state(next_thread, RUNNING, now);
+    start_switch(now);
+    int ret_val = sigsetjmp(cur_thread->env, 1);
+    bool did_just_save_bookmark = ret_val == 0;
+    if(did_just_save_bookmark){
+        reset_timer(scheduler->quantum);
+        increase_quantum(next_thread);
+        siglongjmp(next_thread->env, 1);
+    }
+    finish_switch();
+}
+
+void arm_deadline_timer(){
+    // Sets the timer to the earliest deadline, or disarms it if none.
+    unsigned long long next = scheduler->idle_until_ns;
+    std::multimap<unsigned long long, Thread*>* lists[] = {
+            &scheduler->sleep_deadlines, &scheduler->block_deadlines};
+    for (auto deadlines : lists){
+        if (!deadlines->empty() &&
+        (next == 0 || deadlines->begin()->first < next)){
+            next = deadlines->begin()->first;
+        }
+    }
+    if (next == scheduler->armed_ns){
+        return;
+    }
+    struct itimerspec spec = {{0, 0}, {0, 0}};
+    spec.it_value.tv_sec = next / NANOSECOND;
+    spec.it_value.tv_nsec = next % NANOSECOND;
+    if (timer_settime(scheduler->deadline_timer, TIMER_ABSTIME, &spec, NULL))
+    {
+        std::cerr << SYSTEM_ERROR << SETTIME_ERROR << std::endl;
+        exit(1);
+    }
+    scheduler->armed_ns = next;
+}
+
+void add_deadline(std::multimap<unsigned long long, Thread*>& deadlines,
+                  Thread* thread, unsigned long long deadline_ns){
+    deadlines.insert(std::make_pair(deadline_ns, thread));
+    arm_deadline_timer();
+}
+
+void cancel_deadline(std::multimap<unsigned long long, Thread*>& deadlines,
+                     Thread* thread, unsigned long long& deadline_ns){
+    // The timer is left as it is, firing early only finds nothing to do.
+    if (deadline_ns == 0){
+        return;
+    }
+    auto range = deadlines.equal_range(deadline_ns);
+    for (auto it = range.first; it != range.second; it++){
+        if (it->second == thread){
+            deadlines.erase(it);
+            break;
+        }
+    }
+    deadline_ns = 0;
+}
+
+int expire_deadlines(){
+    // Returns the number of threads made READY, which are put right after
+    // the running thread so that they run next.
+    unsigned long long now = now_ns();
+    // Runs in the DEADLINE_SIGNAL handler, which may interrupt malloc, so the
+    // expired threads are collected on the stack. A thread may have both a
+    // sleep and a block deadline.
+    Thread* expired[2 * MAX_THREAD_NUM];
+    int num_expired = 0;
+    auto it = scheduler->sleep_deadlines.begin();
+    while (it != scheduler->sleep_deadlines.end() && it->first <= now){
+        it->second->sleep_deadline_ns = 0;
+        expired[num_expired++] = it->second;
+        it = scheduler->sleep_deadlines.erase(it);
+    }
+    it = scheduler->block_deadlines.begin();
+    while (it != scheduler->block_deadlines.end() && it->first <= now){
+        // Same as uthread_resume.
+        it->second->block_deadline_ns = 0;
+        it->second->is_blocked = false;
+        it->second->timed_out = true;
+        expired[num_expired++] = it->second;
+        it = scheduler->block_deadlines.erase(it);
+    }
+    int woken = 0;
+    for (int i = 0; i < num_expired; i++){
+        Thread* thread = expired[i];
+        if (thread->state == BLOCKED && !thread->is_blocked &&
+        thread->wakeup_quantum == 0 && thread->sleep_deadline_ns == 0){
+            set_state(thread, READY, now);
+            scheduler->threads_queue.insert(
+                    scheduler->threads_queue.begin() + 1 + woken, thread);
+            woken++;
+        }
+    }
+    return woken;
+}
+
+void deadline_handler(int){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    scheduler->armed_ns = 0;
+    int woken = expire_deadlines();
+    if (scheduler->idle_until_ns != 0 && scheduler->idle_until_ns <= now_ns()){
+        // The idle wait is over, wait_idle notices by itself.
+        scheduler->idle_until_ns = 0;
+    }
+    arm_deadline_timer();
+    if (woken > 0 && !scheduler->idling){
+        // End the running quantum so that the woken threads run now, not
+        // once the threads ahead of them have had their quantums.
+        reset_timer(scheduler->quantum);
+        timer_handler(SIGVTALRM);
+        return;
+    }
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+}
+
+void wait_idle(unsigned long long until_ns){
+    // Suspends the process until until_ns (if not 0) or until a deadline
+    // makes a thread READY. Must be called with the signals blocked;
+    // sigsuspend only lets DEADLINE_SIGNAL in, the virtual timer is stopped anyway.
+    sigset_t wait_mask;
+    sigprocmask(SIG_BLOCK, nullptr, &wait_mask);
+    sigdelset(&wait_mask, DEADLINE_SIGNAL);
+    scheduler->idle_until_ns = until_ns;
+    scheduler->idling = true;
+    arm_deadline_timer();
+    while (scheduler->threads_queue.size() == 1){
+        if (until_ns != 0 ? now_ns() >= until_ns :
+        scheduler->sleep_deadlines.empty() &&
+        scheduler->block_deadlines.empty()){
+            break;
+        }
+        sigsuspend(&wait_mask);
+    }
+    scheduler->idle_until_ns = 0;
+    scheduler->idling = false;
+    arm_deadline_timer();
+}
+
+void init_deadline_timer(){
+    struct sigaction deadline_sa = {};
+    deadline_sa.sa_handler = &deadline_handler;
+    deadline_sa.sa_mask = *scheduler->signals;
+    if (sigaction(DEADLINE_SIGNAL, &deadline_sa, NULL) < 0)
+    {
+        std::cerr << SYSTEM_ERROR << SIGACTION_ERROR << std::endl;
+        exit(1);
+    }
+    struct sigevent event = {};
+    event.sigev_notify = SIGEV_SIGNAL;
+    event.sigev_signo = DEADLINE_SIGNAL;
+    if (timer_create(CLOCK_MONOTONIC, &event, &scheduler->deadline_timer))
+    {
+        std::cerr << SYSTEM_ERROR << TIMER_CREATE_ERROR << std::endl;
+        exit(1);
+    }
+    scheduler->has_deadline_timer = true;
+}
+
+void init_scheduler(int quantum){
+    if (!scheduler->simulated){
+        init_deadline_timer();
+    }
+    Thread *main_thread = new Thread(0);
+    main_thread->state_since_ns = now_ns();
+    scheduler->running = main_thread;
+    scheduler->threads_queue.push_back(main_thread);
+    scheduler->all_threads[main_thread->tid] = main_thread;
+    scheduler->quantum = quantum;
+    reset_timer(quantum);
+}
+
 int uthread_init(int quantum_usecs){
     if(quantum_usecs <= 0){
         std::cerr << THREAD_ERROR << QUANTUM_ERROR << std::endl;
         return -1;
     }
-    Thread *main_thread = new Thread(0);
-    scheduler->threads_queue.push_back(main_thread);
-    scheduler->all_threads[main_thread->tid] = main_thread;
-    scheduler->quantum = quantum_usecs;
-    reset_timer(quantum_usecs);
+    init_scheduler(quantum_usecs);
     return 0;
 }
 
-int uthread_spawn(thread_entry_point entry_point){
-    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+int uthread_init_simulated(int quantum_ticks, unsigned int seed){
+    if(quantum_ticks <= 0){
+        std::cerr << THREAD_ERROR << TICKS_ERROR << std::endl;
+        return -1;
+    }
+    if(seed != 0 && quantum_ticks > INT_MAX / 2){
+        // 2 * quantum_ticks - 1, the longest random quantum, must be an int.
+        std::cerr << THREAD_ERROR << RANDOM_TICKS_ERROR << std::endl;
+        return -1;
+    }
+    scheduler->simulated = true;
+    scheduler->quantum_ticks = quantum_ticks;
+    scheduler->random_state = seed;
+    init_scheduler(quantum_ticks);
+    return 0;
+}
+
+int uthread_init_replay(const int *schedule, int length){
+    if(schedule == nullptr || length <= 0){
+        std::cerr << THREAD_ERROR << SCHEDULE_ERROR << std::endl;
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        if (schedule[i] <= 0){
+            std::cerr << THREAD_ERROR << SCHEDULE_ERROR << std::endl;
+            return -1;
+        }
+    }
+    scheduler->simulated = true;
+    scheduler->replay.assign(schedule, schedule + length);
+    // Once the schedule runs out, quantums keep the length of the last one.
+    scheduler->quantum_ticks = schedule[length - 1];
+    init_scheduler(scheduler->quantum_ticks);
+    return 0;
+}
+
+int spawn_thread(thread_entry_point entry_point){
+    // Must be called with the signals blocked.
     for (int i = 1; i < MAX_THREAD_NUM; ++i) {
         if (scheduler->all_threads[i] == nullptr){
             char* stack_pointer = new char[STACK_SIZE];
             scheduler->all_threads[i] = new Thread(i, stack_pointer,
                                                    entry_point);
             scheduler->all_threads[i]->state = READY;
+            scheduler->all_threads[i]->state_since_ns = now_ns();
             scheduler->threads_queue.push_back(scheduler->all_threads[i]);
-            sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
             return i;
         }
     }
     std::cerr << THREAD_ERROR << MAX_THREAD_NUM_ERROR << std::endl;
-    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
     return -1;
 }
 
+int uthread_spawn(thread_entry_point entry_point){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    int tid = spawn_thread(entry_point);
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return tid;
+}
+
 int uthread_terminate(int tid){
     sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
     if(tid < 0 || tid >= MAX_THREAD_NUM){
@@ -221,9 +852,9 @@ int uthread_terminate(int tid){
         return -1;
     }
     if (tid == 0){
-        // Terminate the main thread, ends the whole process.
+        // Terminate the main thread, ends the whole process. The signals
+        // stay blocked, the scheduler is gone.
         delete scheduler;
-        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
         exit(0);
     }
     Thread* cur_thread = scheduler->all_threads[tid];
@@ -235,15 +866,29 @@ int uthread_terminate(int tid){
         return -1;
     }
 
+    cancel_deadline(scheduler->sleep_deadlines, cur_thread,
+                    cur_thread->sleep_deadline_ns);
+    cancel_deadline(scheduler->block_deadlines, cur_thread,
+                    cur_thread->block_deadline_ns);
+
+    if (cur_thread == scheduler->task_host){
+        // The pending tasks will run once a task is scheduled again.
+        scheduler->task_host = nullptr;
+        scheduler->task_host_idle = false;
+    }
+
     if(tid == scheduler->threads_queue.front()->tid){
         // Thread is Running now
         scheduler->threads_queue.pop_front();
-        delete cur_thread;
+        scheduler->terminated = cur_thread;
         scheduler->all_threads[tid] = nullptr;
         reset_timer(scheduler->quantum);
-        scheduler->threads_queue.front()->state = RUNNING;
+        unsigned long long now = now_ns();
+        set_state(scheduler->threads_queue.front(), RUNNING, now);
+        start_switch(now);
         increase_quantum(scheduler->threads_queue.front());
-        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        // The signals stay blocked until the jump lands, since a timer
+        // signal in between would run on the stack being freed.
         siglongjmp(scheduler->threads_queue.front()->env, 1);
     }
     else{
@@ -292,23 +937,14 @@ int uthread_block(int tid){
     }
     if(tid == scheduler->threads_queue.front()->tid){
         // Thread is running now
-        cur_thread->state = BLOCKED;
+        unsigned long long now = now_ns();
+        set_state(cur_thread, BLOCKED, now);
         cur_thread->is_blocked = true;
-        scheduler->threads_queue.pop_front();
-        Thread* next_thread = scheduler->threads_queue.front();
-        next_thread->state = RUNNING;
-        int ret_val = sigsetjmp(cur_thread->env, 1);
-        bool did_just_save_bookmark = ret_val == 0;
-        if(did_just_save_bookmark){
-            reset_timer(scheduler->quantum);
-            increase_quantum(next_thread);
-            sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
-            siglongjmp(next_thread->env, 1);
-        }
+        switch_from_running(cur_thread, now);
     }
     else {
         // Thread is not running now
-        cur_thread->state = BLOCKED;
+        set_state(cur_thread, BLOCKED, now_ns());
         cur_thread->is_blocked = true;
         for (auto it = scheduler->threads_queue.begin();
         it != scheduler->threads_queue.end(); it++) {
@@ -338,15 +974,18 @@ int uthread_resume(int tid){
         sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
         return -1;
     }
+    cancel_deadline(scheduler->block_deadlines, cur_thread,
+                    cur_thread->block_deadline_ns);
     if (cur_thread->state == BLOCKED){
         // Thread is blocked
-        if (cur_thread->wakeup_quantum > 0){
+        if (cur_thread->wakeup_quantum > 0 ||
+        cur_thread->sleep_deadline_ns != 0){
             // Thread is sleeping
             cur_thread->is_blocked = false;
             sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
             return 0;
         }
-        cur_thread->state = READY;
+        set_state(cur_thread, READY, now_ns());
         cur_thread->is_blocked = false;
         scheduler->threads_queue.push_back(cur_thread);
     }
@@ -359,31 +998,107 @@ int uthread_sleep(int num_quantums){
     sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
     if(num_quantums <= 0){
         std::cerr << THREAD_ERROR << QUANTUM_NUM_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
         return -1;
     }
     Thread *cur_thread = scheduler->threads_queue.front();
     if (cur_thread->tid == 0){
         std::cerr << THREAD_ERROR << BLOCKING_MAIN_THREAD_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
         return -1;
     }
     cur_thread->wakeup_quantum = scheduler->total_quantum + num_quantums + 1;
-    cur_thread->state = BLOCKED;
+    unsigned long long now = now_ns();
+    set_state(cur_thread, BLOCKED, now);
     scheduler->sleeping_threads.insert(cur_thread);
-    scheduler->threads_queue.pop_front();
-    Thread* next_thread = scheduler->threads_queue.front();
-    next_thread->state = RUNNING;
-    int ret_val = sigsetjmp(cur_thread->env, 1);
-    bool did_just_save_bookmark = ret_val == 0;
-    if(did_just_save_bookmark) {
-        reset_timer(scheduler->quantum);
-        increase_quantum(next_thread);
+    switch_from_running(cur_thread, now);
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return 0;
+}
+
+int uthread_sleep_until(unsigned long long deadline_ns){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    if (scheduler->simulated){
+        // Real time would make the schedule depend on the machine.
+        std::cerr << THREAD_ERROR << SIMULATED_DEADLINE_ERROR << std::endl;
         sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
-        siglongjmp(next_thread->env, 1);
+        return -1;
     }
+    Thread *cur_thread = scheduler->threads_queue.front();
+    if (cur_thread->tid == 0){
+        std::cerr << THREAD_ERROR << BLOCKING_MAIN_THREAD_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    unsigned long long now = now_ns();
+    if (deadline_ns <= now){
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return 0;
+    }
+    cur_thread->sleep_deadline_ns = deadline_ns;
+    add_deadline(scheduler->sleep_deadlines, cur_thread, deadline_ns);
+    set_state(cur_thread, BLOCKED, now);
+    switch_from_running(cur_thread, now);
     sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
     return 0;
 }
 
+int uthread_block_until(int tid, unsigned long long deadline_ns){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    if (scheduler->simulated){
+        std::cerr << THREAD_ERROR << SIMULATED_DEADLINE_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    if(tid < 0 || tid >= MAX_THREAD_NUM){
+        // Invalid id
+        std::cerr << THREAD_ERROR << INVALID_ID_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    if(tid == 0){
+        std::cerr << THREAD_ERROR << BLOCKING_MAIN_THREAD_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    Thread* cur_thread = scheduler->all_threads[tid];
+    if(cur_thread == nullptr){
+        // No such thread
+        std::cerr << THREAD_ERROR << NO_THREAD_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    bool is_running = tid == scheduler->threads_queue.front()->tid;
+    cancel_deadline(scheduler->block_deadlines, cur_thread,
+                    cur_thread->block_deadline_ns);
+    unsigned long long now = now_ns();
+    if (deadline_ns <= now){
+        // Blocked and resumed at once, so a thread that was already blocked
+        // is resumed as by uthread_resume.
+        cur_thread->timed_out = true;
+        if (cur_thread->is_blocked){
+            cur_thread->is_blocked = false;
+            if (cur_thread->wakeup_quantum == 0 &&
+            cur_thread->sleep_deadline_ns == 0){
+                set_state(cur_thread, READY, now);
+                scheduler->threads_queue.push_back(cur_thread);
+            }
+        }
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return is_running ? 1 : 0;
+    }
+    cur_thread->block_deadline_ns = deadline_ns;
+    cur_thread->timed_out = false;
+    add_deadline(scheduler->block_deadlines, cur_thread, deadline_ns);
+    // Signals stay blocked, so the deadline cannot expire before the block.
+    uthread_block(tid);
+    if (is_running){
+        // Back from the block, running again.
+        return cur_thread->timed_out ? 1 : 0;
+    }
+    return 0;
+}
+
 int uthread_get_tid(){
     return scheduler->threads_queue.front()->tid;
 }
@@ -409,3 +1124,246 @@ int uthread_get_quantums(int tid){
     sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
     return cur_thread->num_quantum;
 }
+
+int uthread_idle(){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    Thread* main_thread = scheduler->threads_queue.front();
+    if (main_thread->tid != 0){
+        std::cerr << THREAD_ERROR << IDLE_NOT_MAIN_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    int wakeup = next_wakeup_quantum();
+    bool has_deadlines = !scheduler->sleep_deadlines.empty() ||
+                         !scheduler->block_deadlines.empty();
+    if (scheduler->threads_queue.size() > 1 ||
+    (wakeup == 0 && !has_deadlines)){
+        // Either there is work to do, or nothing would ever wake us up.
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return 0;
+    }
+    // Every quantum until the wakeup would have been given to the main
+    // thread, so sleep through all of them at once and account for them
+    // as if the virtual timer had expired each time. The wakeup quantum
+    // itself is started the way the timer would have, so that the woken
+    // thread runs in it. A deadline may end the wait earlier.
+    unsigned long long idle_start = now_ns();
+    set_state(main_thread, RUNNING, idle_start);
+    int idle_quantums;
+    if (scheduler->simulated){
+        // A simulated clock only moves with the threads and has no
+        // deadlines, so its quantums pass at once.
+        idle_quantums = wakeup - scheduler->total_quantum - 1;
+    }
+    else{
+        unsigned long long quantum_ns = (unsigned long long)
+                scheduler->quantum * (NANOSECOND / SECOND);
+        // The current quantum ends when the virtual timer next expires.
+        struct itimerval left;
+        getitimer(ITIMER_VIRTUAL, &left);
+        unsigned long long first_ns =
+                (unsigned long long) left.it_value.tv_sec * NANOSECOND +
+                (unsigned long long) left.it_value.tv_usec *
+                (NANOSECOND / SECOND);
+        if (first_ns == 0 || first_ns > quantum_ns){
+            first_ns = quantum_ns;
+        }
+        unsigned long long idle_until = 0;
+        if (wakeup != 0){
+            idle_until = idle_start + first_ns +
+                    (wakeup - scheduler->total_quantum - 1) * quantum_ns;
+        }
+        wait_idle(idle_until);
+        unsigned long long idle_ns = now_ns() - idle_start;
+        idle_quantums = 0;
+        if (idle_ns >= first_ns){
+            idle_quantums = 1 + (int) ((idle_ns - first_ns) / quantum_ns);
+        }
+        if (wakeup != 0 &&
+        idle_quantums > wakeup - scheduler->total_quantum - 1){
+            idle_quantums = wakeup - scheduler->total_quantum - 1;
+        }
+    }
+    main_thread->state_since_ns = now_ns();
+    scheduler->idle_ns += main_thread->state_since_ns - idle_start;
+    scheduler->total_quantum += idle_quantums;
+    main_thread->num_quantum += idle_quantums;
+    reset_timer(scheduler->quantum);
+    if (scheduler->threads_queue.size() > 1 ||
+    scheduler->total_quantum + 1 == wakeup){
+        // Start the next quantum now, as the timer would have, and hand it
+        // to the woken threads.
+        timer_handler(SIGVTALRM);
+        return 0;
+    }
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return 0;
+}
+
+int uthread_get_stats(int tid, uthread_stats *stats){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    if(tid < 0 || tid >= MAX_THREAD_NUM){
+        // Invalid id
+        std::cerr << THREAD_ERROR << INVALID_ID_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    Thread* cur_thread = scheduler->all_threads[tid];
+    if (cur_thread == nullptr){
+        std::cerr << THREAD_ERROR << NO_THREAD_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    if (stats == nullptr){
+        std::cerr << THREAD_ERROR << STATS_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    // Bring the current state's time up to date before copying.
+    set_state(cur_thread, cur_thread->state, now_ns());
+    stats->run_ns = cur_thread->run_ns;
+    stats->ready_ns = cur_thread->ready_ns;
+    stats->blocked_ns = cur_thread->blocked_ns;
+    stats->voluntary_switches = cur_thread->voluntary_switches;
+    stats->involuntary_switches = cur_thread->involuntary_switches;
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return 0;
+}
+
+int uthread_get_sched_stats(uthread_sched_stats *stats){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    if (stats == nullptr){
+        std::cerr << THREAD_ERROR << STATS_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    stats->total_switches = scheduler->total_switches;
+    stats->idle_ns = scheduler->idle_ns;
+    for (int i = 0; i < SWITCH_LATENCY_BUCKETS; i++) {
+        stats->switch_latency[i] = scheduler->switch_latency[i];
+    }
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return 0;
+}
+
+int uthread_tick(){
+    // In simulated mode neither the virtual timer nor the deadline timer is
+    // ever armed, so no timer signal is raised, the tick count needs no
+    // protection and ticking costs no system call.
+    if (!scheduler->simulated){
+        return 0;
+    }
+    scheduler->ticks_left--;
+    if (scheduler->ticks_left > 0){
+        return 0;
+    }
+    reset_timer(scheduler->quantum);
+    timer_handler(SIGVTALRM);
+    return 0;
+}
+
+int uthread_get_schedule(int *schedule, int max_length){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    if (max_length < 0 || (schedule == nullptr && max_length > 0)){
+        std::cerr << THREAD_ERROR << SCHEDULE_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    int length = (int) scheduler->schedule.size();
+    std::copy(scheduler->schedule.begin(),
+              scheduler->schedule.begin() + std::min(length, max_length),
+              schedule);
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return length;
+}
+
+void* uthread_alloc(size_t size){
+    // Only the calling thread uses its arena, so being preempted in the
+    // middle cannot corrupt it and no signals need to be blocked.
+    void* ptr = scheduler->running->arena.alloc(size);
+    if (ptr == nullptr){
+        std::cerr << THREAD_ERROR << ALLOC_ERROR << std::endl;
+    }
+    return ptr;
+}
+
+int uthread_free(void* ptr){
+    if (ptr == nullptr){
+        return 0;
+    }
+    Thread* cur_thread = scheduler->running;
+    if (block_owner(ptr) != cur_thread->tid){
+        std::cerr << THREAD_ERROR << FREE_OWNER_ERROR << std::endl;
+        return -1;
+    }
+    cur_thread->arena.free(ptr);
+    return 0;
+}
+
+void task_host_entry(){
+    while (true){
+        sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+        scheduler->task_host_idle = false;
+        if (scheduler->ready_tasks.empty()){
+            // Signals stay blocked until the switch, so a task that becomes
+            // ready in between cannot be missed.
+            scheduler->task_host_idle = true;
+            uthread_block(scheduler->task_host->tid);
+            continue;
+        }
+        void* task = scheduler->ready_tasks.front();
+        scheduler->ready_tasks.pop_front();
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        scheduler->resume_task(task);
+    }
+}
+
+namespace uthread {
+namespace detail {
+
+int schedule_task(void* task, int num_quantums, void (*resume)(void*)){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    if (num_quantums < 0){
+        std::cerr << THREAD_ERROR << QUANTUM_NUM_ERROR << std::endl;
+        sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+        return -1;
+    }
+    if (scheduler->task_host == nullptr){
+        int tid = spawn_thread(task_host_entry);
+        if (tid == -1){
+            sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+            return -1;
+        }
+        scheduler->task_host = scheduler->all_threads[tid];
+    }
+    scheduler->resume_task = resume;
+    if (num_quantums == 0){
+        scheduler->ready_tasks.push_back(task);
+        wake_task_host();
+    }
+    else{
+        // Same accounting as uthread_sleep.
+        scheduler->sleeping_tasks.insert(std::make_pair(
+                scheduler->total_quantum + num_quantums + 1, task));
+    }
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return 0;
+}
+
+void* frame_alloc(std::size_t size){
+    // Frames are created and destroyed by different threads, so they live
+    // in the shared arena, which is only used with the signals blocked.
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    void* frame = scheduler->shared_arena.alloc(size);
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+    return frame;
+}
+
+void frame_free(void* frame, std::size_t){
+    sigprocmask(SIG_BLOCK, scheduler->signals, nullptr);
+    scheduler->shared_arena.free(frame);
+    sigprocmask(SIG_UNBLOCK, scheduler->signals, nullptr);
+}
+
+}
+}
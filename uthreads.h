@@ -7,12 +7,33 @@
 #ifndef _UTHREADS_H
 #define _UTHREADS_H
 
+#include <stddef.h>
+
 
 #define MAX_THREAD_NUM 100 /* maximal number of threads */
 #define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#define SWITCH_LATENCY_BUCKETS 16 /* number of buckets in the switch latency histogram */
 
 typedef void (*thread_entry_point)(void);
 
+/* Per-thread statistics, see uthread_get_stats. Times are in nanoseconds. */
+typedef struct {
+    unsigned long long run_ns; /* monotonic (wall) time spent RUNNING, not CPU time, see uthread_get_stats */
+    unsigned long long ready_ns; /* time spent READY, waiting to run */
+    unsigned long long blocked_ns; /* time spent BLOCKED or sleeping */
+    unsigned long voluntary_switches; /* switches caused by the thread blocking or putting itself to sleep */
+    unsigned long involuntary_switches; /* switches caused by the thread's quantum expiring */
+} uthread_stats;
+
+/* Scheduler-wide statistics, see uthread_get_sched_stats. */
+typedef struct {
+    unsigned long total_switches; /* number of switches from one thread to another */
+    unsigned long long idle_ns; /* time spent suspended in uthread_idle */
+    /* switch_latency[i] counts switches that took less than (128 << i) nanoseconds and at least (64 << i)
+     * nanoseconds (no lower bound for bucket 0, no upper bound for the last bucket). */
+    unsigned long switch_latency[SWITCH_LATENCY_BUCKETS];
+} uthread_sched_stats;
+
 /* External interface */
 
 
@@ -25,11 +46,42 @@ typedef void (*thread_entry_point)(void);
  * exactly once.
  * The input to the function is the length of a quantum in micro-seconds.
  * It is an error to call this function with non-positive quantum_usecs.
+ * The library owns SIGVTALRM, which ends the quantums, and SIGRTMIN, which is raised by the real-time timer of
+ * uthread_sleep_until and uthread_block_until. The program must not install its own handlers for them or use the
+ * virtual interval timer.
  *
  * @return On success, return 0. On failure, return -1.
 */
 int uthread_init(int quantum_usecs);
 
+
+/**
+ * @brief Initializes the thread library with a simulated, deterministic clock.
+ *
+ * Behaves like uthread_init, except that no timer is used: a quantum ends after the RUNNING thread has called
+ * uthread_tick a given number of times. If seed is 0 every quantum lasts quantum_ticks ticks, otherwise the length
+ * of each quantum is drawn uniformly from [1, 2 * quantum_ticks - 1] by a pseudo-random generator seeded with seed.
+ * Given the same program, the same arguments always produce the same schedule. uthread_idle returns without waiting,
+ * and the real-time deadlines of uthread_sleep_until and uthread_block_until are not available.
+ * Only one of the init functions may be called. It is an error to call this function with non-positive
+ * quantum_ticks, or with a non-zero seed and quantum_ticks greater than INT_MAX / 2.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init_simulated(int quantum_ticks, unsigned int seed);
+
+
+/**
+ * @brief Initializes the thread library with a simulated clock that replays a recorded schedule.
+ *
+ * Behaves like uthread_init_simulated, except that the i-th quantum lasts schedule[i] ticks, as returned by
+ * uthread_get_schedule in an earlier run. Once the schedule runs out, every quantum lasts as long as the last one.
+ * It is an error to call this function with a null schedule, a non-positive length or a non-positive entry.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_init_replay(const int *schedule, int length);
+
 /**
  * @brief Creates a new thread, whose entry point is the function entry_point with the signature
  * void entry_point(void).
@@ -97,6 +149,36 @@ int uthread_resume(int tid);
 int uthread_sleep(int num_quantums);
 
 
+/**
+ * @brief Blocks the RUNNING thread until the monotonic clock reaches deadline_ns.
+ *
+ * Unlike uthread_sleep, the time is real time: deadline_ns is an absolute time in nanoseconds on CLOCK_MONOTONIC
+ * (as returned by clock_gettime). The deadline is served by a real-time timer that raises SIGRTMIN, so it expires on time even when the
+ * process is idle. The quantum of the RUNNING thread then ends and the thread runs next, ahead of the READY queue,
+ * so it is late only by the time it takes to switch. As with uthread_sleep, resuming the thread before the deadline
+ * has no effect. If deadline_ns has already passed, the function returns immediately.
+ * It is considered an error if the main thread (tid == 0) calls this function, or if the library was initialized
+ * with a simulated clock.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_sleep_until(unsigned long long deadline_ns);
+
+
+/**
+ * @brief Blocks the thread with ID tid like uthread_block, until it is resumed or deadline_ns is reached.
+ *
+ * deadline_ns is an absolute time in nanoseconds on CLOCK_MONOTONIC. If the thread is not resumed by then, it is
+ * resumed automatically once the deadline expires and runs next, as with uthread_sleep_until. Calling this function again
+ * replaces the previous deadline of the thread. The errors are those of uthread_block, and it is also an error to
+ * call this function if the library was initialized with a simulated clock.
+ *
+ * @return On failure, return -1. If a thread blocks itself, return 1 if it was resumed because the deadline
+ * expired (or had already passed), and 0 if it was resumed by uthread_resume. Otherwise return 0.
+*/
+int uthread_block_until(int tid, unsigned long long deadline_ns);
+
+
 /**
  * @brief Returns the thread ID of the calling thread.
  *
@@ -128,4 +210,96 @@ int uthread_get_total_quantums();
 int uthread_get_quantums(int tid);
 
 
+/**
+ * @brief Lets the main thread wait without consuming CPU until a sleeping thread wakes up.
+ *
+ * The virtual timer only advances while the process runs, so a main thread that has nothing left to do would
+ * otherwise have to spin for the sleeping threads to ever wake up. If the main thread is the only READY thread and
+ * at least one thread is sleeping or waiting for a deadline (see uthread_sleep_until and uthread_block_until), the
+ * process is suspended for the real time of the quantums left until the earliest wakeup, or until a deadline
+ * expires first. The quantums that passed are counted as if the main thread had run them. The next quantum then
+ * starts as if the main thread's quantum had expired: the woken threads are added to the READY queue and the main
+ * thread moves to its end, so the quantum counts are the same as if the main thread had spun.
+ * In any other case the function returns immediately.
+ * It is considered an error if a thread other than the main thread (tid == 0) calls this function.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_idle();
+
+
+/**
+ * @brief Fills stats with the statistics of the thread with ID tid.
+ *
+ * The time spent in each state is measured on the monotonic clock since the thread was spawned, and includes the
+ * time spent in its current state up to the call. The counters are updated on every state transition without
+ * entering the kernel, so collecting them costs close to nothing. For the same reason the times are wall-clock
+ * times, not CPU times: run_ns also includes the time in which the OS had descheduled the whole process while the
+ * thread was RUNNING (a CPU-time clock would cost a system call on every switch). If no thread with ID tid exists or
+ * stats is null, it is considered an error.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_stats(int tid, uthread_stats *stats);
+
+
+/**
+ * @brief Fills stats with the scheduler-wide statistics since the library was initialized.
+ *
+ * The latency of a switch is measured from the scheduling decision until the thread being switched to runs again.
+ * A quantum expiring while no other thread is READY is not counted as a switch. It is an error to pass a null stats.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_get_sched_stats(uthread_sched_stats *stats);
+
+
+/**
+ * @brief Counts one tick of the simulated clock for the RUNNING thread.
+ *
+ * Once the quantum's ticks are used up, a new quantum starts exactly as if the timer had expired. Threads call this
+ * function at the points where they may be preempted, typically once per iteration of their work loop. When the
+ * library was initialized with uthread_init the function does nothing.
+ *
+ * @return 0.
+*/
+int uthread_tick();
+
+
+/**
+ * @brief Copies the length, in ticks, of the quantums started so far into schedule, up to max_length of them.
+ *
+ * The first entry is the quantum that started in the init function. Passing the result to uthread_init_replay
+ * reproduces the run. When the library was initialized with uthread_init no quantum is recorded.
+ * It is an error to pass a negative max_length, or a null schedule with a positive max_length.
+ *
+ * @return On success, return the number of quantums recorded, which may exceed max_length. On failure, return -1.
+*/
+int uthread_get_schedule(int *schedule, int max_length);
+
+
+/**
+ * @brief Allocates size bytes from the calling thread's arena.
+ *
+ * Blocks are served from per-thread slabs of power-of-two size classes (16 to 2048 bytes) with a bump pointer and
+ * recycled through per-class free lists; larger blocks get memory of their own. Unlike malloc, the function is safe
+ * to call when the thread may be preempted, and the memory returned is aligned like malloc's. All the memory
+ * allocated by a thread is released when the thread terminates. It is considered an error if the memory cannot be
+ * allocated.
+ *
+ * @return On success, return a pointer to the allocated memory. On failure, return NULL.
+*/
+void *uthread_alloc(size_t size);
+
+
+/**
+ * @brief Returns memory allocated by uthread_alloc to the calling thread's arena.
+ *
+ * Freeing a null pointer has no effect. It is considered an error to free memory allocated by another thread.
+ *
+ * @return On success, return 0. On failure, return -1.
+*/
+int uthread_free(void *ptr);
+
+
 #endif